@@ -0,0 +1,157 @@
+/*
+ * fairbench: wakeup latency of light LWPs sharing the CPU with heavy ones.
+ *
+ *         Heavy LWPs spin for a slice and yield.  Light LWPs park, and a
+ *         separate pthread wakes all of them every millisecond, stamping
+ *         the time.  We report how long the light ones took to actually
+ *         run after their wakeup, under round robin and under FairShare.
+ *         Wakeups that arrive before the last one was handled collapse
+ *         into one, so the count shows how far behind a scheduler fell.
+ *         A last FairShare run gives every other heavy LWP weight 2048
+ *         with lwp_set_weight() and reports how many slices those got
+ *         per slice of a default-weight one (it should be about 2).
+ *
+ *         usage: fairbench [heavy [light [slice_us]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <x86intrin.h>
+#include "lwp.h"
+#include "schedulers.h"
+
+#define MAXLIGHT 64
+#define MAXHEAVY 64
+#define EVENTS   500            /* wakeups per light thread */
+
+static int nheavy = 4, nlight = 4;
+static unsigned long slice;     /* heavy slice, in cycles */
+static volatile int done;
+
+static tid_t light_tid[MAXLIGHT];
+static volatile unsigned long stamp[MAXLIGHT];
+static unsigned long worst, total, samples;
+static unsigned long slices[MAXHEAVY];
+
+static int heavy(void *arg) {
+  long me = (long)arg;
+  unsigned long until;
+
+  while ( !done ) {
+    until = __rdtsc() + slice;
+    while ( __rdtsc() < until )
+      ;
+    slices[me]++;
+    lwp_yield();
+  }
+  return 0;
+}
+
+static int light(void *arg) {
+  long me = (long)arg;
+  unsigned long lat;
+
+  for(;;) {
+    lwp_park();
+    if ( done )
+      break;
+    lat = __rdtsc() - stamp[me];
+    total += lat;
+    samples++;
+    if ( lat > worst )
+      worst = lat;
+  }
+  return 0;
+}
+
+static void *waker(void *arg) {
+  int i,j;
+
+  for(i=0;i<EVENTS;i++) {
+    usleep(1000);
+    for(j=0;j<nlight;j++) {
+      stamp[j] = __rdtsc();
+      lwp_wake(light_tid[j]);
+    }
+  }
+  usleep(10000);                /* let the last wakeups land */
+  done = 1;
+  for(j=0;j<nlight;j++)         /* and send the light ones home */
+    lwp_wake(light_tid[j]);
+  return NULL;
+}
+
+static double cycles_per_us(void) {
+  struct timespec ts = {0, 100000000};
+  unsigned long start = __rdtsc();
+
+  nanosleep(&ts,NULL);
+  return (__rdtsc() - start)/100000.0;
+}
+
+static void run(const char *name, scheduler s, double mhz, int weighted) {
+  unsigned long heavier = 0, lighter = 0;
+  pthread_t io;
+  tid_t tid;
+  long i;
+
+  done = 0;
+  worst = total = samples = 0;
+  memset(slices,0,sizeof(slices));
+  lwp_set_scheduler(s);
+  for(i=0;i<nheavy;i++) {
+    tid = lwp_create(heavy,(void*)i);
+    if ( weighted && !(i & 1) )
+      lwp_set_weight(tid,2048);
+  }
+  for(i=0;i<nlight;i++)
+    light_tid[i] = lwp_create(light,(void*)i);
+
+  pthread_create(&io,NULL,waker,NULL);
+  while ( lwp_wait(NULL) != NO_THREAD )
+    ;
+  pthread_join(io,NULL);
+
+  printf("%-10s mean %9.1f us   worst %9.1f us   (%lu wakeups)\n", name,
+         samples ? total/samples/mhz : 0.0, worst/mhz, samples);
+  if ( weighted && nheavy > 1 ) {
+    for(i=0;i<nheavy;i++)
+      if ( i & 1 )
+        lighter += slices[i];
+      else
+        heavier += slices[i];
+    /* there are (nheavy+1)/2 heavier ones and nheavy/2 lighter ones */
+    printf("%-10s weight 2048 got %.2f slices per weight 1024 slice\n", "",
+           lighter ? (double)heavier/((nheavy+1)/2)/((double)lighter/(nheavy/2))
+           : 0.0);
+  }
+}
+
+int main(int argc, char *argv[]){
+  double mhz;
+  long slice_us = 200;
+
+  if ( argc > 1 ) nheavy   = atoi(argv[1]);
+  if ( argc > 2 ) nlight   = atoi(argv[2]);
+  if ( argc > 3 ) slice_us = atol(argv[3]);
+  if ( nlight > MAXLIGHT )
+    nlight = MAXLIGHT;
+  if ( nheavy > MAXHEAVY )
+    nheavy = MAXHEAVY;
+
+  mhz = cycles_per_us();
+  slice = slice_us * mhz;
+  printf("%d heavy (%ld us slices), %d light, %d wakeups each\n",
+         nheavy, slice_us, nlight, EVENTS);
+
+  lwp_start();
+  run("roundrobin",NULL,mhz,0);
+  run("fairshare",FairShare,mhz,0);
+  run("weighted",FairShare,mhz,1);
+  lwp_exit(0);
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * genbench: a chain of streaming stages, as generators and as LWPs.
+ *
+ *         count -> triple -> keep odd -> sum.  As generators, each
+ *         stage pulls from the one before it with lwp_gen_next(), so
+ *         every element is a direct hand-off between stacks.  As LWPs,
+ *         each stage is its own thread passing elements through a
+ *         one-element slot, and the scheduler decides who runs next.
+ *
+ *         usage: genbench [elements [lwp_elements]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "lwp.h"
+
+static long elements = 100000000;
+static long lwp_elements = 10000000;   /* the LWP chain is much slower */
+
+/**************** as generators ****************/
+
+static int count(void *arg) {
+  long n = (long)arg, i;
+
+  for(i=0;i<n;i++)
+    lwp_gen_yield(i);
+  return 0;
+}
+
+static int triple(void *arg) {
+  unsigned long v;
+
+  while ( lwp_gen_next((generator)arg,&v) )
+    lwp_gen_yield(v*3);
+  return 0;
+}
+
+static int keep_odd(void *arg) {
+  unsigned long v;
+
+  while ( lwp_gen_next((generator)arg,&v) )
+    if ( v & 1 )
+      lwp_gen_yield(v);
+  return 0;
+}
+
+static unsigned long gen_chain(long n) {
+  generator a, b, c;
+  unsigned long v, sum = 0;
+
+  a = lwp_generator_create(count,(void*)n);
+  b = lwp_generator_create(triple,a);
+  c = lwp_generator_create(keep_odd,b);
+  while ( lwp_gen_next(c,&v) )
+    sum += v;
+  lwp_generator_free(c);
+  lwp_generator_free(b);
+  lwp_generator_free(a);
+  return sum;
+}
+
+/**************** as LWPs ****************/
+
+typedef struct slot_st {
+  int full;
+  int eof;
+  unsigned long v;
+} slot;
+
+static slot s1, s2, s3;
+static unsigned long lwp_sum;
+
+static void put(slot *s, unsigned long v) {
+  while ( s->full )
+    lwp_yield();
+  s->v = v;
+  s->full = 1;
+}
+
+static int get(slot *s, unsigned long *v) {
+  while ( !s->full ) {
+    if ( s->eof )
+      return 0;
+    lwp_yield();
+  }
+  *v = s->v;
+  s->full = 0;
+  return 1;
+}
+
+static int lwp_count(void *arg) {
+  long n = (long)arg, i;
+
+  for(i=0;i<n;i++)
+    put(&s1,i);
+  s1.eof = 1;
+  return 0;
+}
+
+static int lwp_triple(void *arg) {
+  unsigned long v;
+
+  while ( get(&s1,&v) )
+    put(&s2,v*3);
+  s2.eof = 1;
+  return 0;
+}
+
+static int lwp_keep_odd(void *arg) {
+  unsigned long v;
+
+  while ( get(&s2,&v) )
+    if ( v & 1 )
+      put(&s3,v);
+  s3.eof = 1;
+  return 0;
+}
+
+static int lwp_sink(void *arg) {
+  unsigned long v;
+
+  while ( get(&s3,&v) )
+    lwp_sum += v;
+  return 0;
+}
+
+static unsigned long lwp_chain(long n) {
+  lwp_create(lwp_count,(void*)n);
+  lwp_create(lwp_triple,NULL);
+  lwp_create(lwp_keep_odd,NULL);
+  lwp_create(lwp_sink,NULL);
+  while ( lwp_wait(NULL) != NO_THREAD )
+    ;
+  return lwp_sum;
+}
+
+/***********************************************/
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char *argv[]){
+  double start, secs;
+  unsigned long sum;
+
+  if ( argc > 1 ) elements     = atol(argv[1]);
+  if ( argc > 2 ) lwp_elements = atol(argv[2]);
+
+  lwp_start();
+
+  start = now();
+  sum = gen_chain(elements);
+  secs = now() - start;
+  printf("generators %11ld elements %8.3f s %7.2f ns/element  (sum %lu)\n",
+         elements, secs, secs*1e9/elements, sum);
+
+  start = now();
+  sum = lwp_chain(lwp_elements);
+  secs = now() - start;
+  printf("lwps       %11ld elements %8.3f s %7.2f ns/element  (sum %lu)\n",
+         lwp_elements, secs, secs*1e9/lwp_elements, sum);
+
+  lwp_exit(0);
+  return 0;
+}
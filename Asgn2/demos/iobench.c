@@ -0,0 +1,124 @@
+/*
+ * iobench: many LWPs doing random 4K reads of a local file.
+ *
+ *         Each LWP reads random blocks, once with plain pread(), which
+ *         stalls every LWP while the disk works, and once with
+ *         lwp_pread(), which parks just the one that asked.  The file is
+ *         opened O_DIRECT where the filesystem allows it so we measure
+ *         the device, not the page cache.  Set LWP_NO_URING to measure
+ *         the helper-thread fallback instead of io_uring; the last line
+ *         says which one lwp_pread() really used.
+ *
+ *         usage: iobench [file [lwps [reads]]]
+ */
+
+#define _GNU_SOURCE             /* for O_DIRECT */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "lwp.h"
+
+#define BLOCK    4096
+#define FILESIZE (256L*1024*1024)
+
+static int fd;
+static long reads = 2000;       /* per LWP */
+static int use_lwp_pread;
+
+static int reader(void *arg) {
+  unsigned int seed = (unsigned int)(long)arg;
+  void *buf;
+  off_t off;
+  long i;
+  ssize_t n;
+
+  if ( posix_memalign(&buf,BLOCK,BLOCK) )
+    return 1;
+  for(i=0;i<reads;i++) {
+    off = (off_t)(rand_r(&seed) % (FILESIZE/BLOCK)) * BLOCK;
+    if ( use_lwp_pread )
+      n = lwp_pread(fd,buf,BLOCK,off);
+    else
+      n = pread(fd,buf,BLOCK,off);
+    if ( n != BLOCK ) {
+      perror("read");
+      break;
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void make_file(const char *name) {
+  char *block;
+  long i;
+
+  if ( (fd = open(name,O_RDWR|O_CREAT,0644)) < 0 ) {
+    perror(name);
+    exit(1);
+  }
+  if ( lseek(fd,0,SEEK_END) >= FILESIZE )
+    return;
+  printf("writing %ld MB to %s\n",FILESIZE>>20,name);
+  block = malloc(1024*1024);
+  for(i=0;i<1024*1024;i++)
+    block[i] = (char)i;
+  for(i=0;i<FILESIZE;i+=1024*1024)
+    if ( pwrite(fd,block,1024*1024,i) < 0 ) {
+      perror(name);
+      exit(1);
+    }
+  fsync(fd);
+  free(block);
+}
+
+static void run(const char *name, int lwps) {
+  double start, secs;
+  long i;
+
+  start = now();
+  for(i=0;i<lwps;i++)
+    lwp_create(reader,(void*)(i+1));
+  while ( lwp_wait(NULL) != NO_THREAD )
+    ;
+  secs = now() - start;
+  printf("%-10s %8.3f s %10.0f reads/s\n",name,secs,lwps*reads/secs);
+}
+
+int main(int argc, char *argv[]){
+  const char *name = "iobench.dat";
+  int lwps = 64, direct;
+
+  if ( argc > 1 ) name  = argv[1];
+  if ( argc > 2 ) lwps  = atoi(argv[2]);
+  if ( argc > 3 ) reads = atol(argv[3]);
+
+  make_file(name);
+  close(fd);
+  direct = (fd = open(name,O_RDONLY|O_DIRECT)) >= 0;
+  if ( !direct && (fd = open(name,O_RDONLY)) < 0 ) {
+    perror(name);
+    exit(1);
+  }
+  printf("%d LWPs x %ld random 4K reads, %s\n",
+         lwps, reads, direct ? "O_DIRECT" : "page cache");
+
+  lwp_start();
+  use_lwp_pread = 0;
+  run("pread",lwps);
+  use_lwp_pread = 1;
+  run("lwp_pread",lwps);
+  printf("lwp_pread went via %s\n",lwp_io_backend());
+  lwp_exit(0);
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * shardbench: request throughput as LWP runtimes are added, one per core.
+ *
+ *         Every shard gets the same number of worker LWPs, handed out
+ *         from shard 0 with lwp_runtime_spawn_on().  Each worker hashes
+ *         a buffer per request and yields between requests, then mails
+ *         its result back to shard 0.  With no sharing on the yield path
+ *         the time should stay flat, and requests/sec grow linearly, as
+ *         shards are added.
+ *
+ *         usage: shardbench [maxshards [workers [requests]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lwp.h"
+
+#define BUFSIZE 4096
+
+static long requests = 20000;   /* per worker */
+static long reports, expected;
+static unsigned long checksum;
+static tid_t main_tid;
+
+static int report(void *arg) {
+  checksum ^= (unsigned long)arg;
+  if ( ++reports == expected )
+    lwp_wake(main_tid);
+  return 0;
+}
+
+static int worker(void *arg) {
+  unsigned char buf[BUFSIZE];
+  unsigned long hash = 14695981039346656037UL;
+  long i,j;
+
+  memset(buf,(int)(long)arg,sizeof(buf));
+  for(i=0;i<requests;i++) {
+    buf[i%BUFSIZE]++;           /* a new request */
+    for(j=0;j<BUFSIZE;j+=8) {
+      hash ^= buf[j];
+      hash *= 1099511628211UL;  /* FNV-1a, every 8th byte */
+    }
+    lwp_yield();
+  }
+  while ( lwp_runtime_spawn_on(0,report,(void*)hash) < 0 )
+    lwp_yield();
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char *argv[]){
+  int maxshards, workers = 8, shards, s, w;
+  double start, secs, base = 0;
+
+  maxshards = sysconf(_SC_NPROCESSORS_ONLN);
+  if ( argc > 1 ) maxshards = atoi(argv[1]);
+  if ( argc > 2 ) workers   = atoi(argv[2]);
+  if ( argc > 3 ) requests  = atol(argv[3]);
+
+  lwp_start();
+  main_tid = lwp_gettid();
+  printf("%d workers per shard, %ld requests each\n",workers,requests);
+  printf("shards   seconds     Mreq/s  speedup\n");
+
+  for(shards=1;shards<=maxshards;shards*=2) {
+    if ( lwp_runtime_init(shards) < 0 ) {
+      perror("lwp_runtime_init");
+      exit(1);
+    }
+    reports = 0;
+    expected = (long)shards*workers;
+
+    start = now();
+    for(s=0;s<shards;s++)
+      for(w=0;w<workers;w++)
+        while ( lwp_runtime_spawn_on(s,worker,(void*)(long)w) < 0 )
+          lwp_yield();
+    while ( reports < expected )
+      if ( lwp_wait(NULL) == NO_THREAD )
+        lwp_park();
+    secs = now() - start;
+
+    while ( lwp_wait(NULL) != NO_THREAD )
+      ;
+    lwp_runtime_stop();
+
+    if ( shards == 1 )
+      base = expected*requests/secs;
+    printf("%6d %9.3f %10.2f %8.2f\n", shards, secs,
+           expected*requests/secs/1e6, expected*requests/secs/base);
+  }
+  printf("checksum %lx\n",checksum);
+  lwp_exit(0);
+  return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * sigwake: waking a parked LWP from a signal handler.
+ *
+ *         lwp_wake() only touches a lock-free queue and an eventfd, so a
+ *         SIGALRM handler may call it.  The sleeper LWP shows three
+ *         things:
+ *           1. a wakeup that lands before lwp_park() isn't lost; the
+ *              park just returns.
+ *           2. an interval timer waking the sleeper while the scheduler
+ *              has nothing else to run and is asleep on the eventfd.
+ *           3. a handler that floods the wake queue gets EAGAIN once
+ *              the queue holds 1024 undrained wakeups, and all of them
+ *              together leave only one permit behind: the park after
+ *              that one sleeps until the next real wakeup.
+ *
+ *         usage: sigwake [ticks]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include "lwp.h"
+
+#define ONCE  0                 /* what the handler does */
+#define FLOOD 1
+
+static volatile sig_atomic_t mode = ONCE;
+static volatile sig_atomic_t queued, full;
+static tid_t sleeper_tid;
+static int ticks = 5;
+
+static void on_alarm(int sig) {
+  int saved = errno;
+
+  if ( mode == FLOOD ) {
+    queued = 0;
+    while ( !lwp_wake(sleeper_tid) )
+      queued++;
+    full = (errno == EAGAIN);
+  } else {
+    lwp_wake(sleeper_tid);
+  }
+  errno = saved;
+}
+
+static void set_timer(long us, int repeat) {
+  struct itimerval it;
+
+  it.it_value.tv_sec  = us / 1000000;
+  it.it_value.tv_usec = us % 1000000;
+  it.it_interval = repeat ? it.it_value : (struct timeval){0, 0};
+  setitimer(ITIMER_REAL,&it,NULL);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int sleeper(void *arg) {
+  double start;
+  int i;
+
+  /* 1: wake first, park second */
+  mode = ONCE;
+  raise(SIGALRM);
+  lwp_park();
+  printf("1. woken before parking, and lwp_park() returned\n");
+
+  /* 2: nothing else is runnable, so the scheduler sleeps in between */
+  set_timer(20000,1);
+  for(i=0;i<ticks;i++) {
+    start = now();
+    lwp_park();
+    printf("2. tick %d after %5.1f ms\n", i+1, (now()-start)*1e3);
+  }
+  set_timer(0,0);
+
+  /* 3: nothing drains the queue while the handler runs */
+  mode = FLOOD;
+  raise(SIGALRM);
+  printf("3. handler queued %d wakeups, then got %s\n", (int)queued,
+         full ? "EAGAIN" : "something else");
+  lwp_park();
+  for(i=0;i<1024/64;i++)        /* let the scheduler drain the rest */
+    lwp_yield();
+  lwp_park();                   /* the one permit they left */
+  mode = ONCE;
+  set_timer(50000,0);
+  start = now();
+  lwp_park();                   /* and there's no second one */
+  printf("   after the flood, the third lwp_park() slept %5.1f ms\n",
+         (now()-start)*1e3);
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  struct sigaction sa;
+
+  if ( argc > 1 ) ticks = atoi(argv[1]);
+
+  sa.sa_handler = on_alarm;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if ( sigaction(SIGALRM,&sa,NULL) < 0 ) {
+    perror("sigaction");
+    exit(1);
+  }
+
+  sleeper_tid = lwp_create(sleeper,NULL);
+  lwp_start();
+  while ( lwp_wait(NULL) != NO_THREAD )
+    ;
+  lwp_exit(0);
+  return 0;
+}
@@ -51,6 +51,13 @@ typedef struct threadinfo_st {
   thread        sched_one;      /* Two more for            */
   thread        sched_two;      /* schedulers to use       */
   thread        exited;         /* and one for lwp_wait()  */
+  unsigned int  wakeflags;      /* lwp_park()/lwp_wake()   */
+  unsigned long vruntime;       /* weighted cycles run and */
+  unsigned int  weight;         /* share (0 is the default)*/
+  unsigned int  schedflags;     /* for the fair scheduler  */
+  thread        sched_up;       /* and its heap parent     */
+  struct generator_st *gen;     /* its innermost generator */
+  thread        tid_next;       /* tid2thread() hash chain */
 } context;
 
 typedef int (*lwpfun)(void *);  /* type for lwp function */
@@ -75,6 +82,28 @@ extern tid_t lwp_wait(int *);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
 extern thread tid2thread(tid_t tid);
+extern int   lwp_set_weight(tid_t tid, unsigned int weight);
+extern void  lwp_park(void);
+extern int   lwp_wake(tid_t tid);   /* async-signal and pthread safe */
+
+/* one runtime per shard, each on its own OS thread */
+extern int   lwp_runtime_init(int shards);  /* caller becomes shard 0 */
+extern int   lwp_runtime_spawn_on(int shard, lwpfun fun, void *arg);
+extern int   lwp_runtime_shard(void);
+extern void  lwp_runtime_stop(void);
+
+/* file I/O that parks the LWP, not the process */
+extern ssize_t lwp_pread(int fd, void *buf, size_t count, off_t offset);
+extern ssize_t lwp_pwrite(int fd, const void *buf, size_t count, off_t offset);
+extern int     lwp_fsync(int fd);
+extern const char *lwp_io_backend(void);   /* "io_uring", ... */
+
+/* generators: pass values straight between stacks, not via the scheduler */
+typedef struct generator_st *generator;
+extern generator lwp_generator_create(lwpfun fun, void *arg);
+extern int   lwp_gen_next(generator gen, unsigned long *value);
+extern void  lwp_gen_yield(unsigned long value);
+extern void  lwp_generator_free(generator gen);
 
 /* for lwp_wait */
 #define TERMOFFSET        8
@@ -86,5 +115,8 @@ extern thread tid2thread(tid_t tid);
 
 /* prototypes for asm functions */
 void swap_rfiles(rfile *old, rfile *new);
+void lwp_trampoline(void);      /* outermost frame of every new LWP */
+unsigned long lwp_gen_switch(void **save, void *to, unsigned long value);
+void lwp_gen_trampoline(void);  /* and of every generator */
 
 #endif
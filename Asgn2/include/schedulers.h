@@ -6,4 +6,5 @@ extern scheduler AlwaysZero;
 extern scheduler ChangeOnSIGTSTP;
 extern scheduler ChooseHighestColor;
 extern scheduler ChooseLowestColor;
+extern scheduler FairShare;
 #endif
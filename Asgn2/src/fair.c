@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <x86intrin.h>
+#include "lwp.h"
+#include "schedulers.h"
+
+/* A fair scheduler: every thread is charged the rdtsc cycles it actually
+ * ran, scaled by FAIR_WEIGHT/weight, and next() always picks the thread
+ * with the smallest virtual runtime.
+ *
+ * The ready threads live in a skew heap linked through sched_one (left)
+ * and sched_two (right), with sched_up pointing back at the parent so
+ * remove() can unlink a thread from the middle right away.  The running
+ * thread is kept out of the heap so it can be charged when it comes back
+ * through next() or remove().
+ */
+#define FAIR_WEIGHT 1024        // what a weight of 0 means
+
+/* schedflags bits */
+#define FAIR_QUEUED  0x1        // linked into the heap
+
+/* from lwp.c */
+extern __thread thread current_thread;
+
+/* per OS thread, like the rest of the runtime */
+static __thread thread root = NULL;
+static __thread thread running = NULL;   // last thread handed out by next()
+static __thread unsigned long run_start; // when it was handed out
+static __thread unsigned long min_vruntime = 0;
+static __thread int count = 0;
+
+static void fair_charge(thread t, unsigned long now){
+    unsigned int weight = t->weight ? t->weight : FAIR_WEIGHT;
+
+    t->vruntime += (now - run_start) * FAIR_WEIGHT / weight;
+}
+
+/**
+ * merge two skew heaps, top down so a long right spine can't blow the
+ * stack
+ * @return the new root
+*/
+static thread fair_merge(thread a, thread b){
+    thread tmp, up = NULL, top = NULL, *link = &top;
+
+    while(a && b){
+        if(b->vruntime < a->vruntime){
+            tmp = a;
+            a = b;
+            b = tmp;
+        }
+        //a wins: merge its right side with b and swap its children
+        *link = a;
+        a->sched_up = up;
+        up = a;
+        tmp = a->sched_two;
+        a->sched_two = a->sched_one;
+        link = &a->sched_one;
+        a = tmp;
+    }
+    if(!a)
+        a = b;
+    if((*link = a))
+        a->sched_up = up;
+    return top;
+}
+
+/**
+ * take a thread out of the heap, wherever it is, by putting the merge of
+ * its children in its place
+*/
+static void fair_unlink(thread t){
+    thread up = t->sched_up, sub;
+
+    if((sub = fair_merge(t->sched_one, t->sched_two)))
+        sub->sched_up = up;
+    if(!up)
+        root = sub;
+    else if(up->sched_one == t)
+        up->sched_one = sub;
+    else
+        up->sched_two = sub;
+    t->sched_one = t->sched_two = t->sched_up = NULL;
+    t->schedflags &= ~FAIR_QUEUED;
+}
+
+static thread fair_pop(void){
+    thread t = root;
+
+    if(t)
+        fair_unlink(t);
+    return t;
+}
+
+static void fair_push(thread t){
+    t->sched_one = t->sched_two = t->sched_up = NULL;
+    t->schedflags |= FAIR_QUEUED;
+    root = fair_merge(root, t);
+}
+
+static void fair_shutdown(void){
+    //hand every thread back clean so other schedulers can have it
+    while(fair_pop())
+        ;
+    running = NULL;
+    count = 0;
+}
+
+static void fair_admit(thread new){
+    count++;
+    //don't let new or long-parked threads take over to catch up
+    if(new->vruntime < min_vruntime)
+        new->vruntime = min_vruntime;
+    if(new == current_thread && !running){
+        //lwp_set_scheduler() moving the caller over: it's running now
+        running = new;
+        run_start = __rdtsc();
+    } else
+        fair_push(new);
+}
+
+static void fair_remove(thread victim){
+    count--;
+    if(victim == running){
+        fair_charge(victim, __rdtsc());
+        running = NULL;
+    } else if(victim->schedflags & FAIR_QUEUED)
+        fair_unlink(victim);
+}
+
+static thread fair_next(void){
+    unsigned long now = __rdtsc();
+    thread t;
+
+    if(running){
+        fair_charge(running, now);
+        fair_push(running);
+    }
+    t = fair_pop();
+
+    running = t;
+    run_start = now;
+    if(t && t->vruntime > min_vruntime)
+        min_vruntime = t->vruntime;
+    return t;
+}
+
+static int fair_qlen(void){
+    return count;
+}
+
+static struct scheduler fair_publish = {NULL, fair_shutdown, fair_admit,
+                                        fair_remove, fair_next, fair_qlen};
+scheduler FairShare = &fair_publish;
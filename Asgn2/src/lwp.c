@@ -1,38 +1,1120 @@
-#include "lwp.h"
-/* double linked list of all the threads*/
-thread LWP_list = NULL;
-thread current_thread = NULL; // current thread pointer
-
-int thread_count = 1;
-
-static struct scheduler rr_publish = {NULL, NULL, rr_admit, rr_remove, rr_next};
-
-/**
- * @param func thread to run
- * @param arg the arguments of the function
- * @param stack_size size of the stack to be created
- * 
-*/
-tid_t lwp_create(lwpfun func, void *arg, size_t stack_size){
-    thread tmp;
-    unsigned long *stack;
-
-    tmp = malloc(sizeof(context));
-    if(!tmp){
-        perror("lwp_create");
-        return (tid_t)-1;
-    }
-    //get the size of the new thread in bytes
-    tmp->stacksize = stack_size * sizeof(unsigned long);
-    //set id
-    tmp->tid = thread_count++;
-
-    
-}
-
-void lwp_yield(void){
-    thread tmp;
-
-    tmp = current_thread;
-}
-
+#define _GNU_SOURCE             // for pthread_setaffinity_np()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include "lwp.h"
+
+#define DEFAULT_STACK (8*1024*1024) // used when RLIMIT_STACK is unlimited
+#define TID_BUCKETS   64            // to start with; doubles as needed
+
+/* wakeflags bits */
+#define LWP_PARKED      0x1         // off the run queue in lwp_park()
+#define LWP_WAKEPENDING 0x2         // woken before it got around to parking
+
+/* lwp_wake() queue: a bounded ring of tids. Each slot carries a sequence
+ * word that says whether it is free or full for a given lap around the
+ * ring, so producers only ever CAS the tail and the scheduler never has
+ * to lock anything to drain it.
+ */
+#define WAKEQ_SIZE 1024             // must be a power of two
+#define WAKEQ_MASK (WAKEQ_SIZE-1)
+#define WAKE_BATCH 64               // most wakeups admitted per round
+#define LAP_FREE(pos) (((pos)/WAKEQ_SIZE)*2)
+#define LAP_FULL(pos) (((pos)/WAKEQ_SIZE)*2+1)
+
+/* Each shard is one OS thread with a runtime of its own: all of the
+ * thread tables and scheduler state below are thread-local, so the
+ * yield path never touches anything another core writes.  Shard 0
+ * belongs to the first OS thread to use the library, and
+ * lwp_runtime_init() adds one pinned pthread per extra shard.  Any
+ * other OS thread has no shard, so lwp_create() and lwp_start() fail
+ * there rather than share shard 0's tids and wake queue.  The only
+ * shared state is each shard's wake queue and its inboxes, and a tid
+ * carries its shard in its top bits so lwp_wake() knows where to send
+ * it.
+ */
+#define MAX_SHARDS   64
+#define SHARD_SHIFT  48
+#define MAILBOX_SIZE 256            // must be a power of two
+#define MAILBOX_MASK (MAILBOX_SIZE-1)
+#define CACHELINE    64
+
+struct wakeslot {
+    _Atomic unsigned long seq;
+    tid_t tid;
+};
+
+struct mail {
+    lwpfun fun;
+    void *arg;
+};
+
+/* one-way lwp_runtime_spawn_on() traffic from a single sending shard */
+struct mailbox {
+    _Atomic unsigned long head __attribute__((aligned(CACHELINE)));
+    _Atomic unsigned long tail __attribute__((aligned(CACHELINE)));
+    struct mail slot[MAILBOX_SIZE];
+};
+
+struct shard {
+    struct wakeslot wakeq[WAKEQ_SIZE];
+    _Atomic unsigned long wakeq_tail   // next slot to claim (producers)
+        __attribute__((aligned(CACHELINE)));
+    _Atomic int poked;              // fd has been written to
+    int fd;                         // eventfd to sleep on when idle
+    unsigned long wakeq_head        // next slot to drain (owner)
+        __attribute__((aligned(CACHELINE)));
+    int backlog;                    // last drain stopped at the batch limit
+    int id;
+    tid_t home;                     // the pthread's own LWP
+    struct mailbox *inbox;          // one per sending shard
+    pthread_t pthread;
+};
+
+/* from lwpio.c */
+extern void lwp_io_round(void);
+extern void lwp_io_release(void);
+
+static struct shard shard0 = {.fd = -1};
+static struct shard *shards[MAX_SHARDS] = {&shard0};
+static atomic_int nshards = 1;
+static atomic_int shard0_taken = 0;
+static atomic_int stopping = 0;       // shards may exit once they're idle
+/* LWPs living on shards 1 and up, plus mail on its way to them.  When
+ * this is 0 they're all idle and can only get busy again from shard 0.
+ */
+static atomic_long shard_work = 0;
+static _Atomic tid_t stop_waiter = NO_THREAD; // in lwp_runtime_stop()
+static cpu_set_t saved_cpus;          // shard 0's affinity before init
+static int cpus_saved = FALSE;
+
+static __thread struct shard *me = NULL;   // NULL until shard_claim()
+
+/* double linked list of all the threads*/
+__thread thread LWP_list = NULL;
+__thread thread current_thread = NULL; // current thread pointer
+
+__thread int thread_count = 1;
+
+static __thread thread exited_head = NULL, exited_tail = NULL; // for lwp_wait
+static __thread thread waiting_head = NULL, waiting_tail = NULL; // in lwp_wait
+static __thread int parked_count = 0;
+static __thread int round_picks = 0;    // picks since I/O was last flushed
+static __thread generator gen_current = NULL; // current LWP's innermost one
+
+/* tid2thread() index: a chained hash on the low bits of the tid.  They
+ * are just a counter, so the threads spread evenly over the buckets.
+ */
+static __thread thread *tid_table = NULL;
+static __thread unsigned long tid_mask = 0;
+static __thread long tid_live = 0;
+
+/* round robin: a circular list linked through sched_one (next) and
+ * sched_two (prev).  rr_head is the next thread to run.
+ */
+static __thread thread rr_head = NULL;
+static __thread int rr_count = 0;
+
+static void rr_admit(thread new){
+    if(!rr_head){
+        new->sched_one = new;
+        new->sched_two = new;
+        rr_head = new;
+    } else {
+        //put it at the tail, just behind the head
+        new->sched_one = rr_head;
+        new->sched_two = rr_head->sched_two;
+        rr_head->sched_two->sched_one = new;
+        rr_head->sched_two = new;
+    }
+    rr_count++;
+}
+
+static void rr_remove(thread victim){
+    if(victim->sched_one == victim){
+        rr_head = NULL;
+    } else {
+        victim->sched_two->sched_one = victim->sched_one;
+        victim->sched_one->sched_two = victim->sched_two;
+        if(rr_head == victim)
+            rr_head = victim->sched_one;
+    }
+    victim->sched_one = victim->sched_two = NULL;
+    rr_count--;
+}
+
+static thread rr_next(void){
+    thread next = rr_head;
+
+    if(next)
+        rr_head = next->sched_one;
+    return next;
+}
+
+static int rr_qlen(void){
+    return rr_count;
+}
+
+static struct scheduler rr_publish = {NULL, NULL, rr_admit, rr_remove, rr_next,
+                                      rr_qlen};
+static __thread scheduler sched = &rr_publish;
+
+/**
+ * @return the size of stack to give a new thread, in bytes
+*/
+static size_t lwp_stacksize(void){
+    struct rlimit rl;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = DEFAULT_STACK;
+
+    if(!getrlimit(RLIMIT_STACK, &rl) && rl.rlim_cur != RLIM_INFINITY)
+        size = rl.rlim_cur;
+    //round up to a whole number of pages
+    return (size + page - 1) / page * page;
+}
+
+static FILE *stackmap = NULL;
+static pthread_once_t stackmap_once = PTHREAD_ONCE_INIT;
+
+static void stackmap_open(void){
+    char path[64];
+    const char *env;
+    int fd, flags = O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC;
+
+    if(!(env = getenv("LWP_STACKMAP")))
+        return;
+    //a path, or anything else for the default
+    if(env[0] == '/'){
+        flags |= O_TRUNC;
+    } else {
+        //anybody can plant a file or symlink in /tmp: only take a new one
+        snprintf(path, sizeof(path), "/tmp/lwp-%d.map", (int)getpid());
+        env = path;
+        flags |= O_EXCL;
+    }
+    if((fd = open(env, flags, 0644)) < 0 || !(stackmap = fdopen(fd, "w"))){
+        perror("lwp stack map");
+        if(fd >= 0)
+            close(fd);
+    }
+}
+
+/**
+ * append a stack range to the stack map, if LWP_STACKMAP is set.
+ * Lines are "start size lwp-<tid>" (or gen-<n> for generators) in hex
+ * like a perf map; a range that gets reused after its owner is gone is
+ * simply listed again, and the later line wins.
+ * @param stack base of the stack
+ * @param size its size in bytes
+ * @param kind "lwp" or "gen"
+ * @param id whose it is
+*/
+static void stackmap_add(void *stack, size_t size, const char *kind,
+                         unsigned long id){
+    pthread_once(&stackmap_once, stackmap_open);
+    if(!stackmap)
+        return;
+    fprintf(stackmap, "%lx %lx %s-%lx\n", (unsigned long)stack,
+            (unsigned long)size, kind, id);
+    fflush(stackmap);
+}
+
+/**
+ * retire a stack range that's about to be unmapped with a
+ * "start size -" line, so nothing is blamed on its old owner
+ * @param stack base of the stack
+ * @param size its size in bytes
+*/
+static void stackmap_remove(void *stack, size_t size){
+    if(!stackmap)
+        return;
+    fprintf(stackmap, "%lx %lx -\n", (unsigned long)stack,
+            (unsigned long)size);
+    fflush(stackmap);
+}
+
+/**
+ * make sure the calling OS thread has a shard.  Shard 0 goes to the
+ * first thread that asks; the others are made by lwp_runtime_init().
+ * @return 0, or -1 (EBUSY) if the caller can't have one
+*/
+static int shard_claim(void){
+    if(me)
+        return 0;
+    if(!atomic_exchange(&shard0_taken, 1)){
+        me = &shard0;
+        return 0;
+    }
+    errno = EBUSY;
+    return -1;
+}
+
+/**
+ * rebuild the tid index from LWP_list with a new number of buckets.
+ * If there's no memory for it, the old index is kept.
+ * @param buckets how many, a power of two
+*/
+static void tid_rehash(unsigned long buckets){
+    thread *table, t;
+
+    if(!(table = calloc(buckets, sizeof(thread))))
+        return;
+    free(tid_table);
+    tid_table = table;
+    tid_mask = buckets - 1;
+    for(t = LWP_list; t; t = t->lib_one){
+        t->tid_next = table[t->tid & tid_mask];
+        table[t->tid & tid_mask] = t;
+    }
+}
+
+static void list_add(thread t){
+    thread *old = tid_table;
+
+    t->lib_two = NULL;
+    t->lib_one = LWP_list;
+    if(LWP_list)
+        LWP_list->lib_two = t;
+    LWP_list = t;
+
+    //keep the chains about one long
+    if(++tid_live > (long)(tid_mask + 1) || !tid_table){
+        tid_rehash(tid_table ? 2 * (tid_mask + 1) : TID_BUCKETS);
+        if(tid_table != old)
+            return;             // the rebuild took care of t
+    }
+    if(tid_table){
+        t->tid_next = tid_table[t->tid & tid_mask];
+        tid_table[t->tid & tid_mask] = t;
+    }
+}
+
+static void list_remove(thread t){
+    thread *link;
+
+    if(t->lib_two)
+        t->lib_two->lib_one = t->lib_one;
+    else
+        LWP_list = t->lib_one;
+    if(t->lib_one)
+        t->lib_one->lib_two = t->lib_two;
+
+    tid_live--;
+    if(!tid_table)
+        return;
+    for(link = &tid_table[t->tid & tid_mask]; *link; link = &(*link)->tid_next)
+        if(*link == t){
+            *link = t->tid_next;
+            break;
+        }
+}
+
+/**
+ * @param func thread to run
+ * @param arg the arguments of the function
+ * @return the new thread's tid, or NO_THREAD on failure
+*/
+tid_t lwp_create(lwpfun func, void *arg){
+    thread tmp;
+    unsigned long *stack;
+
+    if(shard_claim())
+        return NO_THREAD;
+    tmp = calloc(1, sizeof(context));
+    if(!tmp){
+        perror("lwp_create");
+        return NO_THREAD;
+    }
+    //get the size of the new thread in bytes
+    tmp->stacksize = lwp_stacksize();
+    tmp->stack = mmap(NULL, tmp->stacksize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if(tmp->stack == MAP_FAILED){
+        perror("lwp_create");
+        free(tmp);
+        return NO_THREAD;
+    }
+    //set id
+    tmp->tid = (tid_t)me->id << SHARD_SHIFT | thread_count++;
+
+    /* build a frame for swap_rfiles() to "leave; ret" out of: a null
+     * saved rbp, then lwp_trampoline as the return address.  That
+     * leaves the trampoline at the very top of the stack, 16-aligned,
+     * so nothing can unwind past it.
+     */
+    stack = tmp->stack + tmp->stacksize / sizeof(unsigned long);
+    stack[-1] = (unsigned long)lwp_trampoline;
+    stack[-2] = 0;
+    tmp->state.r12 = (unsigned long)func;
+    tmp->state.rdi = (unsigned long)arg;
+    tmp->state.rbp = (unsigned long)(stack - 2);
+    tmp->state.rsp = (unsigned long)(stack - 2);
+    tmp->state.fxsave = FPU_INIT;
+    tmp->status = MKTERMSTAT(LWP_LIVE, 0);
+
+    list_add(tmp);
+    stackmap_add(tmp->stack, tmp->stacksize, "lwp", tmp->tid);
+    if(me->id)
+        atomic_fetch_add(&shard_work, 1);
+    sched->admit(tmp);
+    return tmp->tid;
+}
+
+/**
+ * put a parked thread back on the run queue, or leave it a wakeup to
+ * find if it hasn't parked yet
+ * @param t thread to wake
+*/
+void lwp_unpark(thread t){
+    if(t->wakeflags & LWP_PARKED){
+        t->wakeflags &= ~LWP_PARKED;
+        parked_count--;
+        sched->admit(t);
+    } else {
+        t->wakeflags |= LWP_WAKEPENDING;
+    }
+}
+
+/**
+ * count some of shard_work as done, and tell lwp_runtime_stop() if
+ * that was the last of it
+ * @param n how much
+*/
+static void shard_work_done(long n){
+    tid_t waiter;
+
+    if(atomic_fetch_sub(&shard_work, n) == n
+       && (waiter = atomic_load(&stop_waiter)) != NO_THREAD)
+        while(lwp_wake(waiter) < 0 && errno == EAGAIN)
+            sched_yield();
+}
+
+/**
+ * tell a shard it has wakeups or mail.  Only the first poke since its
+ * last drain costs a syscall.
+ * @param sh shard to poke
+*/
+static void shard_poke(struct shard *sh){
+    unsigned long one = 1;
+
+    if(!atomic_exchange(&sh->poked, 1) && sh->fd >= 0)
+        while(write(sh->fd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+}
+
+static int shard_has_mail(struct shard *sh){
+    struct mailbox *box;
+    int i;
+
+    for(i = 0; sh->inbox && i < nshards; i++){
+        box = &sh->inbox[i];
+        if(atomic_load_explicit(&box->head, memory_order_relaxed)
+           != atomic_load_explicit(&box->tail, memory_order_acquire))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * move up to WAKE_BATCH woken tids from this shard's wake queue onto
+ * the run queue, and start up to WAKE_BATCH threads from its inboxes.
+ * Only ever called from the scheduler.
+*/
+static void shard_drain(void){
+    struct wakeslot *slot;
+    struct mailbox *box;
+    struct mail *m;
+    unsigned long buf, head, tail;
+    thread t;
+    tid_t tid;
+    int n, i, spawned = 0;
+
+    //clear the eventfd before looking at the queues so no poke is lost
+    if(atomic_load_explicit(&me->poked, memory_order_acquire)){
+        if(me->fd >= 0 && read(me->fd, &buf, sizeof(buf)) < 0
+           && errno != EAGAIN)
+            perror("lwp_wake");
+        atomic_store(&me->poked, 0);
+    }
+    me->backlog = FALSE;
+
+    for(n = 0; n < WAKE_BATCH; n++){
+        slot = &me->wakeq[me->wakeq_head & WAKEQ_MASK];
+        if(atomic_load_explicit(&slot->seq, memory_order_acquire)
+           != LAP_FULL(me->wakeq_head))
+            break;
+        tid = slot->tid;
+        atomic_store_explicit(&slot->seq,
+                              LAP_FREE(me->wakeq_head + WAKEQ_SIZE),
+                              memory_order_release);
+        me->wakeq_head++;
+
+        t = tid2thread(tid);
+        if(t && !LWPTERMINATED(t->status))
+            lwp_unpark(t);
+    }
+    if(n == WAKE_BATCH)
+        me->backlog = TRUE;
+
+    for(i = 0; me->inbox && i < nshards; i++){
+        box = &me->inbox[i];
+        head = atomic_load_explicit(&box->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&box->tail, memory_order_acquire);
+        for(n = 0; head != tail && n < WAKE_BATCH; n++, head++){
+            m = &box->slot[head & MAILBOX_MASK];
+            if(lwp_create(m->fun, m->arg) != NO_THREAD)
+                spawned++;
+        }
+        atomic_store_explicit(&box->head, head, memory_order_release);
+        //the mail is an LWP now (counted by lwp_create()), or it failed
+        if(n && me->id)
+            shard_work_done(n);
+        if(head != tail)
+            me->backlog = TRUE;
+    }
+    //get the home thread back to lwp_wait() so it reaps them
+    if(spawned && me->home && (t = tid2thread(me->home)))
+        lwp_unpark(t);
+}
+
+/**
+ * pick the next thread to run.  I/O queued by the threads is only sent
+ * off once they've all had a turn, or when nothing is runnable, so it
+ * goes in batches.  If nothing is runnable but threads are parked,
+ * sleep on the eventfd until somebody wakes one.
+ * @return the next thread, or NULL if there is nothing left to run
+*/
+static thread lwp_pick(void){
+    struct pollfd pfd;
+    unsigned long buf;
+    thread next;
+
+    for(;;){
+        if(me->backlog || atomic_load_explicit(&me->poked,
+                                               memory_order_relaxed))
+            shard_drain();
+        next = sched->next();
+        if(next && ++round_picks < sched->qlen())
+            return next;
+        //all the way round, or out of threads: flush, and reap
+        round_picks = 0;
+        lwp_io_round();
+        if(!next)
+            next = sched->next();
+        if(next || !parked_count || me->fd < 0)
+            return next;
+        if(me->backlog || atomic_load(&me->poked))
+            continue;
+        pfd.fd = me->fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, -1) < 0 && errno != EINTR){
+            perror("lwp_pick");
+            return NULL;
+        }
+        /* I/O completions write the eventfd without poking, so clear it
+         * here.  Anything that did poke is still flagged in poked.
+         */
+        if(read(me->fd, &buf, sizeof(buf)) < 0 && errno != EAGAIN)
+            perror("lwp_pick");
+    }
+}
+
+void lwp_yield(void){
+    thread tmp, next;
+
+    tmp = current_thread;
+    next = lwp_pick();
+    if(!next)
+        exit(LWPTERMSTAT(tmp->status));
+    if(next == tmp)
+        return;
+    current_thread = next;
+    //a generator belongs to the LWP running it, so it goes along too
+    tmp->gen = gen_current;
+    gen_current = next->gen;
+    swap_rfiles(&tmp->state, &next->state);
+}
+
+/**
+ * @param status exit status, only the low 8 bits are kept
+*/
+void lwp_exit(int status){
+    thread tmp, waiter;
+
+    tmp = current_thread;
+    if(!tmp)
+        exit(status);
+    tmp->status = MKTERMSTAT(LWP_TERM, status);
+    sched->remove(tmp);
+    if(me->id)
+        shard_work_done(1);
+
+    tmp->exited = NULL;
+    if(exited_tail)
+        exited_tail->exited = tmp;
+    else
+        exited_head = tmp;
+    exited_tail = tmp;
+
+    //let the oldest waiter have it
+    if((waiter = waiting_head)){
+        waiting_head = waiter->exited;
+        if(!waiting_head)
+            waiting_tail = NULL;
+        sched->admit(waiter);
+    }
+    lwp_yield();
+}
+
+tid_t lwp_gettid(void){
+    return current_thread ? current_thread->tid : NO_THREAD;
+}
+
+/**
+ * @param status where to put the exit status of the reaped thread
+ * @return tid of the reaped thread, or NO_THREAD if nothing could exit
+*/
+tid_t lwp_wait(int *status){
+    thread tmp;
+    tid_t tid;
+
+    while(!exited_head){
+        //nobody else is left who could exit
+        if(!current_thread || (sched->qlen() <= 1 && !parked_count))
+            return NO_THREAD;
+        sched->remove(current_thread);
+        current_thread->exited = NULL;
+        if(waiting_tail)
+            waiting_tail->exited = current_thread;
+        else
+            waiting_head = current_thread;
+        waiting_tail = current_thread;
+        lwp_yield();
+    }
+
+    tmp = exited_head;
+    exited_head = tmp->exited;
+    if(!exited_head)
+        exited_tail = NULL;
+
+    tid = tmp->tid;
+    if(status)
+        *status = tmp->status;
+    list_remove(tmp);
+    if(tmp->stack){
+        stackmap_remove(tmp->stack, tmp->stacksize);
+        munmap(tmp->stack, tmp->stacksize);
+    }
+    free(tmp);
+    return tid;
+}
+
+void lwp_start(void){
+    thread tmp;
+
+    if(current_thread)
+        return;
+    if(shard_claim()){
+        perror("lwp_start");
+        return;
+    }
+    tmp = calloc(1, sizeof(context));
+    if(!tmp){
+        perror("lwp_start");
+        return;
+    }
+    //the calling thread keeps its own stack
+    tmp->tid = (tid_t)me->id << SHARD_SHIFT | thread_count++;
+    tmp->status = MKTERMSTAT(LWP_LIVE, 0);
+    if(me->fd < 0)
+        me->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    list_add(tmp);
+    sched->admit(tmp);
+    current_thread = tmp;
+    lwp_yield();
+}
+
+/**
+ * take the current thread off the run queue until lwp_wake() is called
+ * on it.  Returns at once if a wakeup already arrived.
+*/
+void lwp_park(void){
+    thread tmp = current_thread;
+
+    if(!tmp)
+        return;
+    if(tmp->wakeflags & LWP_WAKEPENDING){
+        tmp->wakeflags &= ~LWP_WAKEPENDING;
+        return;
+    }
+    tmp->wakeflags |= LWP_PARKED;
+    parked_count++;
+    sched->remove(tmp);
+    lwp_yield();
+}
+
+/**
+ * make a parked thread runnable again.  This only touches the owning
+ * shard's wake queue and eventfd, so it is safe from signal handlers
+ * and from other pthreads.
+ * @param tid thread to wake
+ * @return 0 on success, -1 (EAGAIN) if the wake queue is full or
+ * (EINVAL) if there is no such shard
+*/
+int lwp_wake(tid_t tid){
+    struct shard *sh;
+    struct wakeslot *slot;
+    unsigned long pos, seq;
+    int saved = errno, n = atomic_load_explicit(&nshards, memory_order_acquire);
+
+    if((tid >> SHARD_SHIFT) >= (tid_t)n){
+        errno = EINVAL;
+        return -1;
+    }
+    sh = shards[tid >> SHARD_SHIFT];
+    pos = atomic_load_explicit(&sh->wakeq_tail, memory_order_relaxed);
+    for(;;){
+        slot = &sh->wakeq[pos & WAKEQ_MASK];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if(seq == LAP_FREE(pos)){
+            if(atomic_compare_exchange_weak(&sh->wakeq_tail, &pos, pos + 1))
+                break;
+        } else if(seq < LAP_FREE(pos)){
+            //still full from the last lap
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&sh->wakeq_tail, memory_order_relaxed);
+        }
+    }
+    slot->tid = tid;
+    atomic_store_explicit(&slot->seq, LAP_FULL(pos), memory_order_release);
+
+    shard_poke(sh);
+    errno = saved;
+    return 0;
+}
+
+/* Generators run on the stack of whoever calls lwp_gen_next(), never
+ * through the scheduler: next and yield are a direct lwp_gen_switch()
+ * between the two stacks, with the value passed in a register.
+ */
+struct generator_st {
+    void          *sp;          // generator's stack, while it's not running
+    void          *caller_sp;   // consumer's stack, while it is
+    unsigned long *stack;       // base of allocated stack
+    size_t        stacksize;
+    int           done;         // fun has returned
+    lwpfun        fun;
+    void          *arg;
+};
+
+static _Atomic unsigned long gen_count = 0;   // just for the stack map
+
+/**
+ * first (C) function on a generator's stack: run it, then keep
+ * reporting that it's finished
+ * @param gen the generator
+*/
+static void gen_main(generator gen){
+    gen->fun(gen->arg);
+    gen->done = TRUE;
+    for(;;)
+        lwp_gen_switch(&gen->sp, gen->caller_sp, 0);
+}
+
+/**
+ * @param fun generator body; it produces values with lwp_gen_yield()
+ * and ends the stream by returning
+ * @param arg the arguments of the function
+ * @return the new generator, or NULL on failure
+*/
+generator lwp_generator_create(lwpfun fun, void *arg){
+    generator gen;
+    unsigned long *stack;
+
+    gen = calloc(1, sizeof(struct generator_st));
+    if(!gen){
+        perror("lwp_generator_create");
+        return NULL;
+    }
+    gen->stacksize = lwp_stacksize();
+    gen->stack = mmap(NULL, gen->stacksize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if(gen->stack == MAP_FAILED){
+        perror("lwp_generator_create");
+        free(gen);
+        return NULL;
+    }
+    gen->fun = fun;
+    gen->arg = arg;
+
+    /* build what lwp_gen_switch() expects to pop: the FPU control
+     * word and mxcsr, r15..r12, rbx, rbp, and then lwp_gen_trampoline
+     * to return into at the very top of the stack
+     */
+    stack = gen->stack + gen->stacksize / sizeof(unsigned long);
+    stack[-1] = (unsigned long)lwp_gen_trampoline;
+    stack[-2] = 0;                        // rbp
+    stack[-3] = 0;                        // rbx
+    stack[-4] = (unsigned long)gen_main;  // r12
+    stack[-5] = (unsigned long)gen;       // r13
+    stack[-6] = 0;                        // r14
+    stack[-7] = 0;                        // r15
+    stack[-8] = 0x1f80;                   // mxcsr
+    stack[-9] = 0x037f;                   // fpu control word
+    gen->sp = stack - 9;
+
+    stackmap_add(gen->stack, gen->stacksize, "gen", ++gen_count);
+    return gen;
+}
+
+/**
+ * run the generator until it yields its next value
+ * @param gen the generator
+ * @param value where to put the value
+ * @return TRUE if there was a value, FALSE once the generator is done
+*/
+int lwp_gen_next(generator gen, unsigned long *value){
+    generator outer = gen_current;
+    unsigned long tmp;
+
+    if(gen->done)
+        return FALSE;
+    gen_current = gen;
+    tmp = lwp_gen_switch(&gen->caller_sp, gen->sp, 0);
+    gen_current = outer;
+    if(gen->done)
+        return FALSE;
+    if(value)
+        *value = tmp;
+    return TRUE;
+}
+
+/**
+ * hand a value to the consumer and wait to be asked for the next one.
+ * Only makes sense inside a generator.
+ * @param value the value
+*/
+void lwp_gen_yield(unsigned long value){
+    generator gen = gen_current;
+
+    if(gen)
+        lwp_gen_switch(&gen->sp, gen->caller_sp, value);
+}
+
+/**
+ * free a generator.  One that hasn't finished is simply dropped where
+ * it stands, without unwinding anything.
+ * @param gen the generator
+*/
+void lwp_generator_free(generator gen){
+    stackmap_remove(gen->stack, gen->stacksize);
+    munmap(gen->stack, gen->stacksize);
+    free(gen);
+}
+
+void lwp_set_scheduler(scheduler fun){
+    scheduler old = sched;
+    thread tmp;
+
+    if(!fun)
+        fun = &rr_publish;
+    if(fun == old)
+        return;
+    if(fun->init)
+        fun->init();
+    //move everything that's runnable over to the new one
+    while((tmp = old->next())){
+        old->remove(tmp);
+        fun->admit(tmp);
+    }
+    if(old->shutdown)
+        old->shutdown();
+    sched = fun;
+}
+
+scheduler lwp_get_scheduler(void){
+    return sched;
+}
+
+/**
+ * @param tid a thread on this shard
+ * @return the thread, or NULL if there's no such thread here
+*/
+thread tid2thread(tid_t tid){
+    thread tmp;
+
+    if(!tid_table){
+        //never got memory for the index: do it the slow way
+        for(tmp = LWP_list; tmp; tmp = tmp->lib_one)
+            if(tmp->tid == tid)
+                return tmp;
+        return NULL;
+    }
+    for(tmp = tid_table[tid & tid_mask]; tmp; tmp = tmp->tid_next)
+        if(tmp->tid == tid)
+            return tmp;
+    return NULL;
+}
+
+/**
+ * set a thread's share of the CPU under FairShare: weight 2048 runs
+ * twice as much as the default 1024 (0 also means the default)
+ * @return 0, or -1 with errno set if there's no such thread here
+*/
+int lwp_set_weight(tid_t tid, unsigned int weight){
+    thread t;
+
+    if(!(t = tid2thread(tid))){
+        errno = ESRCH;
+        return -1;
+    }
+    t->weight = weight;
+    return 0;
+}
+
+static struct shard *shard_alloc(int id){
+    struct shard *sh;
+
+    if(!(sh = aligned_alloc(CACHELINE, sizeof(struct shard))))
+        return NULL;
+    memset(sh, 0, sizeof(struct shard));
+    sh->id = id;
+    if((sh->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+        free(sh);
+        return NULL;
+    }
+    return sh;
+}
+
+/**
+ * get a shard that's been used before ready to go again.  Wakeups left
+ * in its queue are for LWPs that are gone, so they're dropped.
+ * @param sh shard to reset
+*/
+static void shard_reset(struct shard *sh){
+    unsigned long pos, buf;
+
+    pos = sh->wakeq_head;
+    for(; pos != atomic_load(&sh->wakeq_tail); pos++)
+        atomic_store(&sh->wakeq[pos & WAKEQ_MASK].seq,
+                     LAP_FREE(pos + WAKEQ_SIZE));
+    sh->wakeq_head = pos;
+    if(read(sh->fd, &buf, sizeof(buf)) < 0 && errno != EAGAIN)
+        perror("lwp_runtime_init");
+    atomic_store(&sh->poked, 0);
+    sh->backlog = FALSE;
+}
+
+/**
+ * free every shard's inbox.  The shards themselves are kept for the
+ * next lwp_runtime_init(), since a late lwp_wake() may still be
+ * writing to one.
+*/
+static void shard_free(void){
+    int i;
+
+    for(i = 0; i < MAX_SHARDS && shards[i]; i++){
+        free(shards[i]->inbox);
+        shards[i]->inbox = NULL;
+    }
+}
+
+static void shard_pin(int id){
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/**
+ * body of every shard but 0: run LWPs until lwp_runtime_stop() and
+ * there is nothing left to do
+ * @param arg this shard
+*/
+static void *shard_main(void *arg){
+    thread tmp;
+
+    me = arg;
+    shard_pin(me->id);
+    lwp_start();
+    for(;;){
+        while(lwp_wait(NULL) != NO_THREAD)
+            ;
+        if(atomic_load(&stopping) && !shard_has_mail(me))
+            break;
+        lwp_park();
+    }
+    //take the home thread apart again so the pthread can go
+    lwp_io_release();
+    tmp = current_thread;
+    sched->remove(tmp);
+    list_remove(tmp);
+    free(tmp);
+    free(tid_table);
+    tid_table = NULL;
+    tid_mask = 0;
+    current_thread = NULL;
+    return NULL;
+}
+
+/**
+ * split into shards: the caller becomes shard 0 and every other shard
+ * is a new pthread with a runtime of its own, each pinned to a core
+ * @param count how many shards in all
+ * @return 0 on success, -1 on failure
+*/
+int lwp_runtime_init(int count){
+    int i;
+
+    if(shard_claim())
+        return -1;
+    if(me != &shard0 || nshards > 1 || count < 1 || count > MAX_SHARDS){
+        errno = EINVAL;
+        return -1;
+    }
+    for(i = 0; i < count; i++){
+        if(i && !shards[i] && !(shards[i] = shard_alloc(i)))
+            break;
+        if(i)
+            shard_reset(shards[i]);
+        if(!(shards[i]->inbox = aligned_alloc(CACHELINE,
+                                    count * sizeof(struct mailbox))))
+            break;
+        memset(shards[i]->inbox, 0, count * sizeof(struct mailbox));
+    }
+    if(i < count){
+        shard_free();
+        errno = ENOMEM;
+        return -1;
+    }
+
+    atomic_store(&stopping, 0);
+    atomic_store(&nshards, count);
+    //shard 0 is the caller's own thread, so put it back the way it was
+    cpus_saved = !pthread_getaffinity_np(pthread_self(), sizeof(saved_cpus),
+                                         &saved_cpus);
+    shard_pin(0);
+    for(i = 1; i < count; i++){
+        //its home thread will be the first one it makes
+        shards[i]->home = (tid_t)i << SHARD_SHIFT | 1;
+        if(pthread_create(&shards[i]->pthread, NULL, shard_main, shards[i])){
+            perror("lwp_runtime_init");
+            //let the ones that did start wind down
+            atomic_store(&nshards, i);
+            lwp_runtime_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * start fun(arg) as a new LWP on another shard.  This is one
+ * single-producer ring per pair of shards, so it may only be called
+ * from a shard's own OS thread.
+ * @param shard where to run it
+ * @param fun thread to run
+ * @param arg the arguments of the function
+ * @return 0 on success, -1 (EAGAIN) if that inbox is full, or
+ * (ESHUTDOWN) if lwp_runtime_stop() is shutting that shard down
+*/
+int lwp_runtime_spawn_on(int shard, lwpfun fun, void *arg){
+    struct mailbox *box;
+    unsigned long tail;
+
+    if(shard_claim())
+        return -1;
+    if(shard < 0 || shard >= nshards){
+        errno = EINVAL;
+        return -1;
+    }
+    if(shards[shard] == me)
+        return lwp_create(fun, arg) == NO_THREAD ? -1 : 0;
+    if(shard && atomic_load(&stopping)){
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    box = &shards[shard]->inbox[me->id];
+    tail = atomic_load_explicit(&box->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&box->head, memory_order_acquire)
+       == MAILBOX_SIZE){
+        errno = EAGAIN;
+        return -1;
+    }
+    //count it before the shard can see it, so shard_work can't touch 0
+    if(shard)
+        atomic_fetch_add(&shard_work, 1);
+    box->slot[tail & MAILBOX_MASK].fun = fun;
+    box->slot[tail & MAILBOX_MASK].arg = arg;
+    atomic_store_explicit(&box->tail, tail + 1, memory_order_release);
+    shard_poke(shards[shard]);
+    return 0;
+}
+
+/**
+ * @return the caller's shard, or -1 if it doesn't have one yet
+*/
+int lwp_runtime_shard(void){
+    return me ? me->id : -1;
+}
+
+/**
+ * @return the eventfd this shard sleeps on when it's idle
+*/
+int lwp_shard_fd(void){
+    if(shard_claim())
+        return -1;
+    if(me->fd < 0)
+        me->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return me->fd;
+}
+
+/**
+ * wait for the other shards to run out of work, including anything
+ * already sent to them, then shut them down.  Call from an LWP on
+ * shard 0; its other LWPs keep running meanwhile, and anything sent to
+ * shard 0 is started before this returns.
+*/
+void lwp_runtime_stop(void){
+    int i, n = nshards;
+
+    //1: park until no LWP or mail is left on the other shards
+    atomic_store(&stop_waiter, lwp_gettid());
+    while(atomic_load(&shard_work))
+        lwp_park();
+    atomic_store(&stop_waiter, NO_THREAD);
+
+    /* 2: only shard 0 can make them busy again, and the caller is what
+     * shard 0 is running, so they're idle for good: let them go
+     */
+    atomic_store(&stopping, 1);
+    for(i = 1; i < n; i++)
+        while(lwp_wake(shards[i]->home) < 0 && errno == EAGAIN)
+            sched_yield();
+    for(i = 1; i < n; i++)
+        pthread_join(shards[i]->pthread, NULL);
+    //start whatever they sent here before the inboxes go
+    while(shard_has_mail(me))
+        shard_drain();
+    //no new lwp_wake() can pick a stopped shard after this
+    atomic_store(&nshards, 1);
+    shard_free();
+    if(cpus_saved)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved_cpus),
+                               &saved_cpus);
+}
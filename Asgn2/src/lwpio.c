@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "lwp.h"
+
+/* File I/O that parks the calling LWP instead of blocking the runtime.
+ *
+ * Requests go to a per-shard io_uring when the kernel has one that can
+ * do IORING_OP_READ and _WRITE (5.6 on), and to a small pool of helper
+ * pthreads when it doesn't (or LWP_NO_URING is set).  Either way they
+ * are only queued up here; lwp_io_round(), which the scheduler calls
+ * once every runnable thread has had a turn, or when none is left,
+ * hands the whole batch over with one io_uring_enter() or one trip
+ * through the pool's lock.
+ */
+#define RING_ENTRIES 256
+#define POOL_THREADS 4
+#define PROBE_OPS    256            // room for every opcode there can be
+
+#define IO_UNKNOWN 0
+#define IO_URING   1
+#define IO_POOL    2
+
+struct lwp_io {
+    int            op;          // IORING_OP_READ, _WRITE or _FSYNC
+    int            fd;
+    void           *buf;
+    size_t         len;
+    off_t          off;
+    long           res;         // result, or -errno
+    _Atomic int    done;
+    thread         owner;
+    tid_t          tid;
+    struct lwp_io  *next;
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries, cq_entries;
+    unsigned to_submit;
+    void *sq_map, *cq_map;          // the mappings, for uring_free()
+    size_t sq_size, cq_size, sqes_size;
+};
+
+/* from lwp.c */
+extern __thread thread current_thread;
+extern void lwp_unpark(thread t);
+extern int lwp_shard_fd(void);
+
+static __thread int io_mode = IO_UNKNOWN;
+static __thread struct uring ring;
+static __thread int inflight = 0;                  // handed out, not reaped
+static __thread struct lwp_io *batch_head = NULL;  // for the pool, not sent
+static __thread struct lwp_io *batch_tail = NULL;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct lwp_io *pool_head = NULL, *pool_tail = NULL;
+
+/**
+ * do one request the ordinary, blocking way
+ * @return the result, or -errno
+*/
+static long io_now(struct lwp_io *req){
+    long res;
+
+    switch(req->op){
+    case IORING_OP_READ:
+        res = pread(req->fd, req->buf, req->len, req->off);
+        break;
+    case IORING_OP_WRITE:
+        res = pwrite(req->fd, req->buf, req->len, req->off);
+        break;
+    default:
+        res = fsync(req->fd);
+        break;
+    }
+    return res < 0 ? -errno : res;
+}
+
+static void *pool_main(void *arg){
+    struct lwp_io *req;
+    tid_t tid;
+
+    for(;;){
+        pthread_mutex_lock(&pool_lock);
+        while(!pool_head)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        req = pool_head;
+        if(!(pool_head = req->next))
+            pool_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        req->res = io_now(req);
+        //req lives on the LWP's stack; don't touch it once it's done
+        tid = req->tid;
+        atomic_store_explicit(&req->done, 1, memory_order_release);
+        while(lwp_wake(tid) < 0 && errno == EAGAIN)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void pool_start(void){
+    pthread_attr_t attr;
+    pthread_t helper;
+    int i;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for(i = 0; i < POOL_THREADS; i++)
+        if(pthread_create(&helper, &attr, pool_main, NULL))
+            perror("lwp io pool");
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * unmap and close this shard's io_uring, or whatever of it got set up
+*/
+static void uring_free(void){
+    if(ring.sqes)
+        munmap(ring.sqes, ring.sqes_size);
+    if(ring.cq_map && ring.cq_map != ring.sq_map)
+        munmap(ring.cq_map, ring.cq_size);
+    if(ring.sq_map)
+        munmap(ring.sq_map, ring.sq_size);
+    close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+}
+
+/**
+ * @return 0 if the ring can do every op we hand it, -1 if not (kernels
+ * before 5.6 have no IORING_OP_READ or _WRITE, and no probe either)
+*/
+static int uring_probe(void){
+    struct io_uring_probe *probe;
+    int ok;
+
+    probe = calloc(1, sizeof(*probe) +
+                   PROBE_OPS * sizeof(struct io_uring_probe_op));
+    if(!probe)
+        return -1;
+    ok = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+                 probe, PROBE_OPS) >= 0
+        && probe->last_op >= IORING_OP_WRITE
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+/**
+ * map a new io_uring for this shard and point its completions at the
+ * shard's eventfd, so an idle scheduler wakes up for them
+ * @return 0 on success, -1 if there's no io_uring to be had
+*/
+static int uring_setup(void){
+    struct io_uring_params p;
+    char *sq, *cq;
+    void *map;
+    int efd;
+
+    memset(&p, 0, sizeof(p));
+    memset(&ring, 0, sizeof(ring));
+    if((ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0)
+        return -1;
+    if(uring_probe())
+        goto fail;
+    //one mapping for both rings if the kernel will do that
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if((p.features & IORING_FEAT_SINGLE_MMAP) && ring.cq_size > ring.sq_size)
+        ring.sq_size = ring.cq_size;
+    map = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if(map == MAP_FAILED)
+        goto fail;
+    ring.sq_map = map;
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        ring.cq_map = ring.sq_map;
+    } else {
+        map = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if(map == MAP_FAILED)
+            goto fail;
+        ring.cq_map = map;
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(map == MAP_FAILED)
+        goto fail;
+    ring.sqes = map;
+
+    sq = ring.sq_map;
+    cq = ring.cq_map;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.entries = p.sq_entries;
+    ring.cq_entries = p.cq_entries;
+
+    efd = lwp_shard_fd();
+    if(efd >= 0 && syscall(__NR_io_uring_register, ring.fd,
+                           IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    uring_free();
+    return -1;
+}
+
+static void uring_enter(void){
+    int n;
+
+    while(ring.to_submit){
+        n = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 0, 0,
+                    NULL, 0);
+        if(n < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            perror("lwp io submit");
+            return;
+        }
+        ring.to_submit -= n;
+    }
+}
+
+static void uring_queue(struct lwp_io *req){
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    tail = *ring.sq_tail;
+    if(tail - atomic_load_explicit((_Atomic unsigned *)ring.sq_head,
+                                   memory_order_acquire) == ring.entries)
+        uring_enter();
+    sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->op;
+    sqe->fd = req->fd;
+    sqe->addr = (unsigned long)req->buf;
+    sqe->len = req->len;
+    sqe->off = req->off;
+    sqe->user_data = (unsigned long)req;
+    ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+    atomic_store_explicit((_Atomic unsigned *)ring.sq_tail, tail + 1,
+                          memory_order_release);
+    ring.to_submit++;
+}
+
+static void uring_reap(void){
+    struct io_uring_cqe *cqe;
+    struct lwp_io *req;
+    unsigned head, tail;
+
+    head = *ring.cq_head;
+    tail = atomic_load_explicit((_Atomic unsigned *)ring.cq_tail,
+                                memory_order_acquire);
+    for(; head != tail; head++){
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        req = (struct lwp_io *)(unsigned long)cqe->user_data;
+        req->res = cqe->res;
+        atomic_store_explicit(&req->done, 1, memory_order_relaxed);
+        lwp_unpark(req->owner);
+    }
+    atomic_store_explicit((_Atomic unsigned *)ring.cq_head, head,
+                          memory_order_release);
+}
+
+/**
+ * called by the scheduler once per round, or when it runs dry: send
+ * this round's requests off in one go and wake whoever's requests have
+ * finished
+*/
+void lwp_io_round(void){
+    if(!inflight)
+        return;
+    if(io_mode == IO_URING){
+        if(ring.to_submit)
+            uring_enter();
+        uring_reap();
+    } else if(batch_head){
+        pthread_mutex_lock(&pool_lock);
+        if(pool_tail)
+            pool_tail->next = batch_head;
+        else
+            pool_head = batch_head;
+        pool_tail = batch_tail;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+        batch_head = batch_tail = NULL;
+    }
+}
+
+/**
+ * give back this OS thread's io_uring.  Called when a shard's pthread
+ * is done with its LWPs, so there's nothing in flight.
+*/
+void lwp_io_release(void){
+    if(io_mode == IO_URING)
+        uring_free();
+    io_mode = IO_UNKNOWN;
+}
+
+/**
+ * @return how this OS thread's lwp_pread() and friends get done:
+ * "io_uring", "helper threads", or "undecided" before the first one
+*/
+const char *lwp_io_backend(void){
+    switch(io_mode){
+    case IO_URING:
+        return "io_uring";
+    case IO_POOL:
+        return "helper threads";
+    default:
+        return "undecided";
+    }
+}
+
+/**
+ * queue a request and park until it's done
+ * @return the result, or -1 with errno set
+*/
+static long lwp_io(struct lwp_io *req){
+    if(!current_thread){
+        //not in an LWP, so there's nobody else to run anyway
+        req->res = io_now(req);
+    } else {
+        if(io_mode == IO_UNKNOWN)
+            io_mode = (!getenv("LWP_NO_URING") && !uring_setup()) ?
+                IO_URING : IO_POOL;
+        req->owner = current_thread;
+        req->tid = current_thread->tid;
+        req->done = 0;
+        if(io_mode == IO_URING){
+            //don't hand out more than the completion ring can hold
+            while(inflight >= (int)ring.cq_entries)
+                lwp_yield();
+            uring_queue(req);
+        } else {
+            pthread_once(&pool_once, pool_start);
+            req->next = NULL;
+            if(batch_tail)
+                batch_tail->next = req;
+            else
+                batch_head = req;
+            batch_tail = req;
+        }
+        inflight++;
+        while(!atomic_load_explicit(&req->done, memory_order_acquire))
+            lwp_park();
+        inflight--;
+    }
+    if(req->res < 0){
+        errno = -req->res;
+        return -1;
+    }
+    return req->res;
+}
+
+ssize_t lwp_pread(int fd, void *buf, size_t count, off_t offset){
+    struct lwp_io req = {.op = IORING_OP_READ, .fd = fd, .buf = buf,
+                         .len = count, .off = offset};
+
+    return lwp_io(&req);
+}
+
+ssize_t lwp_pwrite(int fd, const void *buf, size_t count, off_t offset){
+    struct lwp_io req = {.op = IORING_OP_WRITE, .fd = fd, .buf = (void *)buf,
+                         .len = count, .off = offset};
+
+    return lwp_io(&req);
+}
+
+int lwp_fsync(int fd){
+    struct lwp_io req = {.op = IORING_OP_FSYNC, .fd = fd};
+
+    return lwp_io(&req);
+}